@@ -23,14 +23,20 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#define _GNU_SOURCE	// RUSAGE_THREAD
 #include <stdio.h>
 #include <stdarg.h>
 #include <unistd.h> // sleep()
 #include <stdlib.h> // malloc()/free()
 #include <sys/time.h>   // timeval
+#include <time.h>	// clock_gettime
 #include <sys/ioctl.h>	// key handler
 #include <string.h>
+#include <stdint.h>
 #include <math.h> // round
+#include <stdatomic.h>	// feedback slot
+#include <sys/resource.h>	// getrusage
+#include <pthread.h>	// jack_activate helper
 
 #include <jack/jack.h>
 #include <jack/ringbuffer.h>
@@ -58,12 +64,44 @@
 #define ctlRepeat			1
 #define preload				7
 #define outpreload			3
-#define fbAdjust			3
+#define outPackets			40	// ISO packets per output transfer, 8 per ms
+#define outPktFrames			12	// nominal frames per ISO packet at 96k
+#define outPktMin			11	// clamp for the per packet frame count, +/-1 frame is all the original code ever sent..
+#define outPktMax			13	// ..so we know the device takes it. Also sizes the buffers
+#define fbSmooth			7	// feedback rate filter shift, 2^7 packets = 16ms time constant
+#define fbPacketsMax			64	// feedback ISO packets per transfer (-fp), 8 per ms
+#define fbQueueMax			16	// feedback transfers queued (-fq)
 #define innames				{"ch1","ch3","ch5","ch7","mixL","ch2","ch4","ch6","ch8","mixR"}
 #define outnames			{"2trackL","2trackR"}
 
-#define PLAY_LATENCY		(480*outpreload+RB_TARGET_LENGTH) // frames, 480 * USB preload queue plus the ring buffer
-#define CAP_LATENCY		(2048+IB_TARGET_LENGTH) // frames, 2048 in USB BULK transfer plus the ring buffer
+#define PLAY_USB_LATENCY	(outPackets*outPktFrames*outpreload) // frames, 480 * USB preload queue
+#define CAP_USB_LATENCY		2048 // frames, 2048 in USB BULK transfer
+#define PLAY_LATENCY		(PLAY_USB_LATENCY+RB_TARGET_LENGTH) // frames, USB queue plus the ring buffer
+#define CAP_LATENCY		(CAP_USB_LATENCY+IB_TARGET_LENGTH) // frames, USB transfer plus the ring buffer
+#define LAT_REPORT_STEP		16	// frames the live latency must move before we ask JACK to recompute totals
+
+// round trip latency calibration - needs a loopback cable from the 2-track out to any mixer input
+#define MLS_ORDER		14
+#define MLS_LENGTH		((1<<MLS_ORDER)-1) // 16383 frames = 170ms period, must be longer than the round trip
+#define MLS_TAPS		0x3802	// Galois LFSR feedback mask, x^14+x^13+x^12+x^2+1
+#define MLS_LEVEL		0.25	// test signal amplitude, -12dBFS
+#define CAL_LAGS		32	// correlation lags computed per event loop pass, keeps USB serviced while we crunch
+#define CAL_MIN_SNR		8.0	// correlation peak must be this many times the mean to count as a detection
+
+// direct playback path (-D): jack_process encodes S24_3LE straight into a ring of URB payloads, no float ring
+#define DIRECT_FRAMES		4096	// frames in the URB payload ring, power of 2
+#define DIRECT_GUARD		(outPackets*outPktMax)	// frames mirrored past the end so every transfer is contiguous
+
+// adaptive ring targets (-a): set the shallowest rings that keep late completions below a probability bound
+#define JIT_BIN			8	// frames of lateness per jitter histogram bin
+#define JIT_BINS		256	// last bin catches anything later than ~21ms
+#define JIT_DECAY		0.99	// per controller tick (100ms), old jitter fades over ~20s
+#define ADAPT_WARMUP		10000	// ms of statistics after first audio before we move the targets
+#define TARGET_GROW		64	// max frames a target rises per tick..
+#define TARGET_SHRINK		4	// ..and falls - shrink slowly so a burst of jitter is not forgotten too soon
+
+#define REPLAY_FRAMES		(96000*30)	// capture frames pushed through the kernels by one replay run (30s of audio)
+#define REPLAY_PERIOD		256	// JACK period the replay runs process_rings() with
 
 // hacked from libmaru
 #define USB_CLASS_AUDIO                1
@@ -112,23 +150,77 @@ static int done = 0;
 
 static libusb_context *ctx = NULL;
 
-static int outDelta = 0; // tracks if we need to add/remove a sample to the next block - value accumulates the delta reported by feedback ISO packets
+static double fbFilt = outPktFrames; // feedback filter state, frames per ISO packet - kept wide so the filter has no rounding bias
+static int fbRate = outPktFrames<<16; // playback rate requested by the feedback ISO packets - Q16.16 frames per ISO packet
+static int fbPackets = 8; // feedback ISO packets per transfer - 1ms, the device only updates the counters once per ms anyway
+static int fbQueue = 4; // feedback transfers kept queued
+// latest filtered rate (high 32 bits) and timestamp of the newest packet in it (us since start, low 32 bits),
+// published by fb_in and read by the pacer in one atomic op so they can live on different threads
+static _Atomic unsigned long long fbSlot = (unsigned long long)(outPktFrames<<16)<<32;
+static double fbAgeMax = 0; // oldest feedback the pacer used since the last status line, ms
+static long cbcount = 0; // USB callbacks handled
+
+// direct playback path - free running frame counters, masked into dring. Ordering:
+// drel (sent, space for jack_process) <= dres (handed to a transfer) <= dwr (encoded by jack_process)
+static int direct = 0;
+static unsigned char *dring = NULL; // (DIRECT_FRAMES+DIRECT_GUARD)*6 bytes of S24_3LE
+static _Atomic unsigned int dwr = 0; // written by jack_process
+static _Atomic unsigned int dres = 0; // written by cb_out
+static _Atomic unsigned int drel = 0; // written by cb_out
+
+// ring targets in frames, thresholds above follow them
+static int rbtarget = RB_TARGET_LENGTH;
+static int ibtarget = IB_TARGET_LENGTH;
+static int adaptive = 0;
+static double adapt_bound = 1e-5; // acceptable probability that one completion is later than the margin
+
+// completion lateness histogram for one event source
+struct jitter {
+	unsigned long bins[JIT_BINS]; // counts, only written by the thread the events happen on
+	double last; // time of the previous event, ms
+	unsigned long seen[JIT_BINS]; // controller (main loop) side - counts already folded into hist
+	double hist[JIT_BINS]; // decayed counts
+};
+static struct jitter jit_bulk, jit_out, jit_jack;
+static int paceAcc = 0; // Q16.16 fraction of a frame carried from one ISO packet to the next
 
 jack_port_t *output_port[10];
 jack_port_t *input_port[2];
 jack_client_t *client;
 int running = 0;
 
+// lifecycle tracking
+static struct timespec t_start; // process start, reference for all phase timings
+static double t_phase = 0; // end of the last init phase
+static volatile double t_first_audio = 0; // set by jack_process when the first captured audio reaches JACK
+static double t_stop = 0; // when the stop request was seen
+static int inflight = 0; // USB transfers owned by libusb, counted down as they retire during shutdown
+static int stopping = 0; // shutting down - callbacks retire their transfer instead of resubmitting
+static _Atomic int activated = 0; // jack_activate() result from the helper thread: 0 pending, 1 ok, -1 failed
+static int force_reset = 0; // always reset the device configuration on startup
+static FILE *dumpf = NULL; // raw USB capture for offline replay (-d)
+
+// latency reporting - live values follow the ring depths, cal_offset is the measured round trip excess over them
+static int play_latency = PLAY_LATENCY;
+static int cap_latency = CAP_LATENCY;
+static int cal_offset = 0;
+
+// calibration state: 0=off, 1=waiting to start, 2=playing MLS/recording, 3=captured, 4=correlating
+static volatile int calstate = 0;
+static long calpos = 0; // frames since the MLS started, owned by jack_process while calstate==2
+static float *mls = NULL; // one MLS period
+static float *calbuf = NULL; // one period of all 10 capture channels, recorded one period after the MLS started
+
 // some consts to calculate for later
 const size_t sample_size = sizeof(jack_default_audio_sample_t);
 const size_t ibframe = 10*sample_size;
 const size_t ibsize = ibframe*IB_FRAME_LENGTH;
-const size_t ibtlow = ibframe*(IB_TARGET_LENGTH-DEADBAND);
-const size_t ibthigh = ibframe*(IB_TARGET_LENGTH+DEADBAND);
+size_t ibtlow = ibframe*(IB_TARGET_LENGTH-DEADBAND); // not const, the adaptive controller (-a) moves these
+size_t ibthigh = ibframe*(IB_TARGET_LENGTH+DEADBAND);
 const size_t rbframe = 2*sample_size;
 const size_t rbsize = rbframe*RB_FRAME_LENGTH;
-const size_t rbtlow = rbframe*(RB_TARGET_LENGTH-DEADBAND);
-const size_t rbthigh = rbframe*(RB_TARGET_LENGTH+DEADBAND);
+size_t rbtlow = rbframe*(RB_TARGET_LENGTH-DEADBAND); // not const, the adaptive controller (-a) moves these
+size_t rbthigh = rbframe*(RB_TARGET_LENGTH+DEADBAND);
 
 // ring buffer for 10 channel flow from USB in
 jack_ringbuffer_t *ib;
@@ -162,6 +254,47 @@ void logger(int lvl, const char *fmt, ...) {
 	va_end(argptr);
 }
 
+// milliseconds since startup - monotonic clock via vDSO, so OK to call from RT callbacks
+static double elapsed_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec-t_start.tv_sec)*1000.0 + (ts.tv_nsec-t_start.tv_nsec)/1000000.0;
+}
+
+// log how long the init phase just finished took
+static void phase(const char *name) {
+	double t = elapsed_ms();
+	logger(0,"PHASE %s: %.2fms (total %.2fms)\n", name, t-t_phase, t);
+	t_phase = t;
+}
+
+// record an event that should have come expect_ms after the previous one - RT-safe
+static void jitter_mark(struct jitter *j, double now, double expect_ms) {
+	if(j->last>0) {
+		double late = (now-j->last-expect_ms)*96/JIT_BIN; // early is harmless, only late events drain a ring
+		j->bins[late<0 ? 0 : late>=JIT_BINS ? JIT_BINS-1 : (int)late]++;
+	}
+	j->last = now;
+}
+
+// fold in new events and return the lateness in frames exceeded with probability <= adapt_bound
+// until we have seen enough events for that this is the worst case so far
+static int jitter_margin(struct jitter *j) {
+	double total = 0;
+	for(int b=0; b<JIT_BINS; b++) {
+		unsigned long c = j->bins[b];
+		j->hist[b] = j->hist[b]*JIT_DECAY + (c-j->seen[b]);
+		j->seen[b] = c;
+		total += j->hist[b];
+	}
+	double tail = 0;
+	for(int b=JIT_BINS-1; b>=0; b--) {
+		tail += j->hist[b];
+		if(tail > adapt_bound*total) return (b+1)*JIT_BIN;
+	}
+	return 0;
+}
+
 // SIGNAL handlers
 
 static void sig_handler(int sig) {
@@ -178,27 +311,141 @@ void jack_shutdown (void *arg)
 void jack_latency (jack_latency_callback_mode_t mode, void *arg) {
 	logger(0,"\nJACK latency callback. Mode=%d\n", mode);
 	jack_latency_range_t range;
+	// we are a physical device, so our ports are the ends of the chain - just report what we add
 	if (mode == JackCaptureLatency) {
 		for(int i=0; i<10; i++) {
-			//jack_port_get_latency_range (input_port[i], mode, &range); // I dont understand this at all?? what is it doing here?
-			range.min = CAP_LATENCY;
-			range.max = CAP_LATENCY;
+			range.min = cap_latency;
+			range.max = cap_latency;
 			jack_port_set_latency_range (output_port[i], mode, &range);
 		}
 	} else {
 		for(int i=0; i<2; i++) {
-			//jack_port_get_latency_range (input_port[i], mode, &range); // I dont understand this at all?? what is it doing here?
-			range.min = PLAY_LATENCY;
-			range.max = PLAY_LATENCY;
+			range.min = play_latency;
+			range.max = play_latency;
 			jack_port_set_latency_range (input_port[i], mode, &range);
 		}
 	}
 }
 
+// recalculate latency from the live ring depths plus calibration, tell JACK if it moved
+// call from the main loop only - jack_recompute_total_latencies() is not allowed in the process callback
+static void update_latency(void) {
+	int pl = PLAY_USB_LATENCY + rbavg/rbframe + cal_offset/2;
+	int cl = CAP_USB_LATENCY + (int)(ibavg/ibframe) + (cal_offset-cal_offset/2);
+	pl = pl<0 ? 0 : pl;
+	cl = cl<0 ? 0 : cl;
+	if(abs(pl-play_latency)>=LAT_REPORT_STEP || abs(cl-cap_latency)>=LAT_REPORT_STEP) {
+		logger(0,"\nlatency play:%d cap:%d\n", pl, cl);
+		play_latency = pl;
+		cap_latency = cl;
+		jack_recompute_total_latencies(client);
+	}
+}
+
+// move the ring thresholds to follow the targets
+static void set_targets(void) {
+	rbtlow = rbframe*(rbtarget-DEADBAND);
+	rbthigh = rbframe*(rbtarget+DEADBAND);
+	ibtlow = ibframe*(ibtarget-DEADBAND);
+	ibthigh = ibframe*(ibtarget+DEADBAND);
+}
+
+// step a target towards want, rising faster than falling, within [lo,hi]
+static int slew_target(int cur, int want, int lo, int hi) {
+	want = want<lo ? lo : want>hi ? hi : want;
+	if(want>cur) return want-cur>TARGET_GROW ? cur+TARGET_GROW : want;
+	return cur-want>TARGET_SHRINK ? cur-TARGET_SHRINK : want;
+}
+
+// adaptive controller, once per status tick from the main loop
+// each ring has to ride out its producer being late and its consumer being early (seen as the previous one late):
+//   capture: half a BULK transfer on average in the ring plus BULK and JACK lateness
+//   playback: half an output transfer plus half a JACK period plus output and JACK lateness
+// plus the deadband either side so the +/-1 frame correction kicks in before we run dry.
+// The rings walk to a new target through the usual +/-1 frame per period add/drop, so changes are click free
+static void adapt_targets(void) {
+	// always fold in the statistics so the decay runs at a steady rate
+	int mb = jitter_margin(&jit_bulk);
+	int mo = jitter_margin(&jit_out);
+	int mj = jitter_margin(&jit_jack);
+	if(adaptive==0 || t_first_audio==0 || elapsed_ms()-t_first_audio<ADAPT_WARMUP) return;
+	int period = jack_get_buffer_size(client);
+	int it = CAP_USB_LATENCY/2 + mb + mj + 2*DEADBAND;
+	int rt = outPackets*outPktFrames/2 + period/2 + mo + mj + 2*DEADBAND;
+	// leave room in each ring for a whole transfer/period on top of the target
+	int rmax = (direct ? DIRECT_FRAMES-outpreload*outPackets*outPktMax : RB_FRAME_LENGTH-outPackets*outPktMax) - 1024 - DEADBAND;
+	int imax = IB_FRAME_LENGTH - CAP_USB_LATENCY - 1024 - DEADBAND;
+	int ni = slew_target(ibtarget, it, 2*DEADBAND, imax);
+	int nr = slew_target(rbtarget, rt, 2*DEADBAND, rmax);
+	if(ni!=ibtarget || nr!=rbtarget) {
+		logger(0,"\ntargets RB:%d IB:%d (jitter out:%d bulk:%d jack:%d frames)\n", nr, ni, mo, mb, mj);
+		ibtarget = ni;
+		rbtarget = nr;
+		set_targets();
+	}
+}
+
+// fill mls[] with one period of a maximum length sequence
+static void mls_generate(void) {
+	unsigned int lfsr = 1;
+	for(int i=0; i<MLS_LENGTH; i++) {
+		mls[i] = (lfsr&1) ? MLS_LEVEL : -MLS_LEVEL;
+		lfsr = (lfsr>>1) ^ ((lfsr&1) ? MLS_TAPS : 0);
+	}
+}
+
+// one slice of the circular cross-correlation of the recorded channel against the MLS
+// returns 1 when all lags are done and the result has been applied
+static int calibrate_step(void) {
+	static int ch, lag;
+	static double peak, sum;
+	static int peaklag;
+	if(calstate==3) {
+		// pick the channel with the loopback on it - the one with most energy
+		double best = 0;
+		for(int c=0; c<10; c++) {
+			double e = 0;
+			for(int p=0; p<MLS_LENGTH; p++) e += calbuf[p*10+c]*calbuf[p*10+c];
+			if(e>best) { best = e; ch = c; }
+		}
+		lag = 0; peak = 0; sum = 0; peaklag = 0;
+		calstate = 4;
+	}
+	for(int n=0; n<CAL_LAGS && lag<MLS_LENGTH; n++, lag++) {
+		// y[p] was captured MLS_LENGTH+p frames after the start, correlate with m[(p-lag) mod N]
+		double r = 0;
+		int m = (MLS_LENGTH-lag)%MLS_LENGTH;
+		for(int p=0; p<MLS_LENGTH; p++) {
+			r += calbuf[p*10+ch]*mls[m];
+			if(++m==MLS_LENGTH) m = 0;
+		}
+		r = fabs(r); // loopback may invert polarity
+		sum += r;
+		if(r>peak) { peak = r; peaklag = lag; }
+	}
+	if(lag<MLS_LENGTH) return 0;
+	double snr = peak/(sum/MLS_LENGTH);
+	if(snr<CAL_MIN_SNR) {
+		logger(1,"\nCalibration failed: no test signal found (peak/mean %.1f) - check loopback cable\n", snr);
+	} else {
+		// measured round trip covers both rings at their current depth, keep only the excess
+		cal_offset = peaklag - (PLAY_USB_LATENCY + rbavg/rbframe) - (CAP_USB_LATENCY + (int)(ibavg/ibframe));
+		logger(1,"\nCalibration: round trip %d frames (%.2fms) on %s, latency offset %+d frames (use -l %d to skip calibration)\n",
+			peaklag, peaklag/96.0, ((char *[])innames)[ch], cal_offset, cal_offset);
+		play_latency = cap_latency = -LAT_REPORT_STEP; // force a report
+		update_latency();
+	}
+	calstate = 0;
+	return 1;
+}
+
 /**
  * The process callback for this JACK application
  */
 
+static int direct_write(jack_default_audio_sample_t *in[2], jack_nframes_t nframes, int late);
+static int process_rings(jack_default_audio_sample_t *out[10], jack_default_audio_sample_t *in[2], jack_nframes_t nframes, int late);
+
 int jack_process (jack_nframes_t nframes, void *arg)
 {
 	jack_default_audio_sample_t *out[10], *in[2];
@@ -207,6 +454,8 @@ int jack_process (jack_nframes_t nframes, void *arg)
 	
 	if(nframes>1024) { logger(1,"JACK: too many frames!%d\n",nframes); return 0; }
 
+	jitter_mark(&jit_jack, elapsed_ms(), nframes/96.0);
+
 	// get the buffers
 	//fprintf(stderr,"b");
 	for(int i=0; i<10; i++) {
@@ -216,6 +465,13 @@ int jack_process (jack_nframes_t nframes, void *arg)
 		in[i] = (jack_default_audio_sample_t*)jack_port_get_buffer(input_port[i], nframes);
 	}
 
+	return process_rings(out, in, nframes, jack_frames_since_cycle_start(client));
+}
+
+// move one period between the JACK port buffers and the rings, no JACK calls so replay (-R) can drive it
+// late: frames since the cycle started, allowed for in the depth averages
+static int process_rings(jack_default_audio_sample_t *out[10], jack_default_audio_sample_t *in[2], jack_nframes_t nframes, int late)
+{
 	// fill output ports from input ring buffer
 	int nb = jack_ringbuffer_read_space(ib); // bytes available
 	int nr = nframes*ibframe; // bytes needed by jack
@@ -229,7 +485,7 @@ int jack_process (jack_nframes_t nframes, void *arg)
 	} else {
 		// adjust samples read to keep buffer at target size - clamp to +/- 1 frame per period. Allow for jack internal latency also
 		// update moving average of buffer that will be remaining AFTER we read it
-		ibavg += ((nb-nr-jack_frames_since_cycle_start(client)*ibframe)/AVGSCALE)-(ibavg/AVGSCALE);
+		ibavg += ((nb-nr-late*ibframe)/AVGSCALE)-(ibavg/AVGSCALE);
 		int sd = 0;
 		// clamp to +/- 1 frames
 		if(ibavg<ibtlow) { sd = -1; }
@@ -241,6 +497,7 @@ int jack_process (jack_nframes_t nframes, void *arg)
 	static jack_default_audio_sample_t ab[1025*10]; // temp transfer buffer - max 1024 frames! 1 extra allowed for dropping frames
 	jack_default_audio_sample_t *pab = ab+(na/sample_size); // pointer to next sample in buffer
 	if(na>0) {
+		if(t_first_audio==0) t_first_audio = elapsed_ms();
 		jack_ringbuffer_read(ib, (void *)ab, na); // 
 		// duplicate last samples as required
 		while(na<nr) {
@@ -249,6 +506,13 @@ int jack_process (jack_nframes_t nframes, void *arg)
 			na+=sample_size;
 			ibadd++; // count resample in samples added
 		}
+		// calibrating: record the second MLS period, by then the loopback is carrying the periodic signal
+		if(calstate==2) {
+			for(int i=0; i<nframes; i++) {
+				long p = calpos+i-MLS_LENGTH;
+				if(p>=0 && p<MLS_LENGTH) memcpy(calbuf+p*10, ab+i*10, ibframe);
+			}
+		}
 		pab = ab;
 		for(int i=0; i<nframes; i++ ) {
 			// fill up outputs from the audio buffer in blocks of 10 channels
@@ -260,6 +524,24 @@ int jack_process (jack_nframes_t nframes, void *arg)
 		}
 	}	
 	
+	if(calstate==2) {
+		if(na==0) {
+			// capture glitched, the recording is useless - start over
+			calpos = 0;
+		} else {
+			// replace playback with the test signal on both channels
+			static jack_default_audio_sample_t calsig[1024];
+			for(int i=0; i<nframes; i++) {
+				calsig[i] = mls[(calpos+i)%MLS_LENGTH];
+			}
+			in[0] = in[1] = calsig;
+			calpos += nframes;
+			if(calpos>=2*MLS_LENGTH) calstate = 3;
+		}
+	}
+
+	if(direct) return direct_write(in, nframes, late);
+
 	// fill output ring buffer from input ports
 	pab = ab;
 	for(int i=0; i<nframes; i++) {
@@ -280,8 +562,7 @@ int jack_process (jack_nframes_t nframes, void *arg)
 	} else {
 		// adjust samples written to keep buffer at target size - clamp to +/- 1 frame per period, allow for jack internal latency also
 		// update moving average of buffer
-		rbavg += ((nb+jack_frames_since_cycle_start(client)*rbframe)/AVGSCALE)-(rbavg/AVGSCALE);
-		int sd = 0;
+		rbavg += ((nb+late*rbframe)/AVGSCALE)-(rbavg/AVGSCALE);
 		// clamp to +/- 1 frames
 		na = nr;
 		if(rbavg<rbtlow) {
@@ -316,93 +597,243 @@ static void send_control(libusb_device_handle *hdev, uint16_t ctl[], unsigned ch
 	if(r < 0) { logger(1, libusb_strerror(r)); return;}
 }
 
+// DSP kernels - shared by the USB callbacks and the offline replay (-R) used for PGO training and benchmarks
+
+// size each ISO packet from the feedback rate, carrying the fraction forward so
+// corrections are spread one frame at a time across the packets that need them
+// returns the frames in the transfer
+static int pace_packets(struct libusb_iso_packet_descriptor *desc) {
+	unsigned long long slot = atomic_load_explicit(&fbSlot, memory_order_acquire);
+	int rate = slot>>32;
+	// the timestamp wraps every ~71 minutes, modular subtraction keeps the age right across it
+	double age = (uint32_t)((uint32_t)(uint64_t)(elapsed_ms()*1000)-(uint32_t)slot)/1000.0;
+	if(age>fbAgeMax) fbAgeMax = age;
+	int nf = 0;
+	for(int i=0; i<outPackets; i++) {
+		paceAcc += rate;
+		int n = paceAcc>>16;
+		n = n<outPktMin ? outPktMin : n>outPktMax ? outPktMax : n;
+		paceAcc -= n<<16;
+		desc[i].length = n*6;
+		nf += n;
+	}
+	return nf;
+}
+
+// transcode one sample to S24_3LE
+static inline void s24(jack_default_audio_sample_t f, unsigned char *bp) {
+	int sample = f*((float)INT_MAX);
+	for(int b=0; b<3; b++) {
+		sample >>=8; //shift byte down
+		*bp = sample&0xff; // mask and add to output
+		bp++; // increment output pointer
+	}
+}
+
+// transcode ns interleaved samples to S24_3LE
+static void encode_s24(const jack_default_audio_sample_t *pab, unsigned char *bp, int ns) {
+	for(int i=0; i<ns; i++) {
+		s24(*pab, bp);
+		bp += 3;
+		pab++;
+	}
+}
+
+// fold nc feedback counters adding up to fSum, the newest from time ts (ms), into the playback rate and publish it
+static void fb_update(unsigned int fSum, int nc, double ts) {
+	// low pass into a frames per ISO packet (1/8 ms) rate, keeps the fraction the integer counts hide
+	// weighted by packet count so the time constant does not depend on how the packets were batched
+	// (an integer filter with >> floors negative steps and settles tens of ppm low)
+	double rate = fSum/(8.0*nc);
+	fbFilt += (rate-fbFilt)*(nc/3)/(1<<fbSmooth);
+	fbFilt = fbFilt<outPktMin ? outPktMin : fbFilt>outPktMax ? outPktMax : fbFilt;
+	fbRate = lround(fbFilt*65536); // publish as Q16.16
+	atomic_store_explicit(&fbSlot, ((unsigned long long)fbRate<<32) | (uint32_t)(uint64_t)(ts*1000), memory_order_release);
+}
+
+// decode nr rows of BULK capture into 5 float samples per row
+// format: rows of 32 bytes, of which 24 are valid, rest are padding
+// each byte contain 1 bit of a sample, up to 5 samples/byte
+// 2 rows make up all the channel samples for one frame
+static void decode_rows(const unsigned char *bpos, float *ap, int nr) {
+	for(int row=0;row<nr; row++) { // step through rows
+		// assemble row bits into 5 samples
+		int sample[5] = {0,0,0,0,0};
+		for(int b=0;b<24;b++) {
+			unsigned char bb = *bpos;
+			for(int ch=0; ch<5; ch++) {
+				sample[ch] <<= 1; // shift sample up one bit
+				sample[ch] |= 0x01&bb; // OR channel bit into sample
+				bb >>= 1; // shift to next channel bit
+			}
+			bpos++; // move to next buffer byte
+		}
+		// convert samples into floats and serialize into temp store
+		for(int s=0; s<5; s++) {
+			*ap = (sample[s]<<8)/(float)INT_MAX;
+			ap++;
+		}
+		// move transfer buffer point to next row
+		bpos+=8;
+	}
+}
+
+// append a raw USB payload to the capture dump (-d) for offline replay
+static void dump_record(char type, const unsigned char *data, int len) {
+	if(dumpf==NULL) return;
+	fputc(type, dumpf);
+	fwrite(&len, sizeof(len), 1, dumpf);
+	fwrite(data, 1, len, dumpf);
+}
+
+// direct playback path: encode nframes from the JACK ports straight into the URB payload ring
+// same +/- 1 frame depth control as the float ring, depth here is the frames not yet handed to a transfer
+static int direct_write(jack_default_audio_sample_t *in[2], jack_nframes_t nframes, int late) {
+	unsigned int w = atomic_load_explicit(&dwr, memory_order_relaxed);
+	unsigned int depth = w-atomic_load_explicit(&dres, memory_order_acquire);
+	unsigned int space = DIRECT_FRAMES-(w-atomic_load_explicit(&drel, memory_order_acquire));
+	// check for buffer overrun - allow for an extra frame of padding
+	if(nframes+1>space) {
+		logger(1,"\nOUT: overrun! space=%d\n",space);
+		// drop incoming and reset moving avg to current depth
+		rbavg = depth*rbframe;
+		return 0;
+	}
+	// update moving average of buffer, allow for jack internal latency also
+	rbavg += (((depth+late)*rbframe)/AVGSCALE)-(rbavg/AVGSCALE);
+	int n = nframes;
+	if(rbavg<rbtlow) { n++; rbadd++; } // too low, duplicate the last frame
+	if(rbavg>rbthigh) { n--; rbdrop++; } // too high, drop the last frame
+	for(int i=0; i<n; i++) {
+		int src = i<nframes ? i : nframes-1;
+		unsigned int f = (w+i)&(DIRECT_FRAMES-1);
+		unsigned char *bp = dring+f*6;
+		s24(in[0][src], bp);
+		s24(in[1][src], bp+3);
+		// keep the mirror past the end up to date so a transfer never has to wrap
+		if(f<DIRECT_GUARD) memcpy(dring+(DIRECT_FRAMES+f)*6, bp, 6);
+	}
+	atomic_store_explicit(&dwr, w+n, memory_order_release);
+	return 0;
+}
+
 static void cb_out(struct libusb_transfer *transfer)
 {
 	//fprintf(stderr,"o");
+	cbcount++;
 	if(transfer->status != LIBUSB_TRANSFER_COMPLETED) {
 		logger(1,"!o\n"); // report failures
 	}
-	if(transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+	if(transfer->status == LIBUSB_TRANSFER_CANCELLED || stopping) {
+		inflight--;
+	} else {
 		//fprintf(stderr,"o");
-		// adjust frame size up/down by 1 sample (6 bytes) according to outDelta required.
-		// scale factor adjusts sensitivity of feedback loop!
-		int sd = outDelta/fbAdjust;
-		sd = (sd > 0) - (sd < 0); // reduce to -1/0/+1 range
-		if(sd!=0) { 
-			outDelta=0; // reset accumulator if we adjusted this transfer
-		}
-		int nr = rbframe*(480+sd); // bytes required from ring buffer
-		transfer->length = 2880+(sd*6); // adjust bytes conveyed in transaction
-		transfer->iso_packet_desc[39].length = 72+(sd*6); // adjust size of last ISO subframe to cater!
+		jitter_mark(&jit_out, elapsed_ms(), transfer->length/6/96.0);
+		if(direct && transfer->buffer!=transfer->user_data) {
+			// the ring frames this transfer just sent are free for jack_process again
+			// (ISO completes in submission order, so releases stay in step with reservations)
+			atomic_fetch_add_explicit(&drel, transfer->length/6, memory_order_release);
+		}
+		int nf = pace_packets(transfer->iso_packet_desc); // frames in this transfer
+		int nr = rbframe*nf; // bytes required from ring buffer
+		transfer->length = nf*6; // adjust bytes conveyed in transaction
+		if(direct) {
+			// jack_process already encoded the audio - just point the transfer at the next slice of the ring
+			unsigned int rd = atomic_load_explicit(&dres, memory_order_relaxed);
+			unsigned int avail = atomic_load_explicit(&dwr, memory_order_acquire)-rd;
+			if(running && avail>=nf) {
+				transfer->buffer = dring+(rd&(DIRECT_FRAMES-1))*6;
+				atomic_store_explicit(&dres, rd+nf, memory_order_release);
+			} else {
+				if(running) logger(1,"\nOUT underrun! buf=%d\n",avail);
+				// send zeros from the transfer's own buffer
+				transfer->buffer = transfer->user_data;
+				memset(transfer->buffer,0,transfer->length);
+			}
+			nr = 0;
+		}
 		// collect audio from ring buffer - pad it out by duplicating if there isn't enough
 		int nb = jack_ringbuffer_read_space(rb); // bytes available
 		int na = nr; // bytes to actually transfer
-		if(nb<nr) {
+		if(nr==0) {
+			// direct path, nothing to copy
+		} else if(running==0) {
+			// not started yet (or stopping) - keep the ISO stream primed with silence
+			memset(transfer->buffer,0,transfer->length);
+			na = 0;
+		} else if(nb<nr) {
 			logger(1,"\nOUT underrun! buf=%d\n",nb);
 			// send zeros, leave samples in buffer
 			memset(transfer->buffer,0,transfer->length);
 			na = 0;
 		}
-		static jack_default_audio_sample_t ab[962]; // temp transfer buffer, 480 frames + 1 extra for adjustment
+		static jack_default_audio_sample_t ab[2*outPackets*outPktMax]; // temp transfer buffer, sized for the largest packets
 		if(na>0) {
 			jack_ringbuffer_read(rb, (void *)ab, na);
 			// transcode to S24_3LE into USB output buffer
-			jack_default_audio_sample_t *pab = ab;
-			char *bp = transfer->buffer;
-			for(int i=0; i<480+sd; i++) {
-				for(int ch=0; ch<2; ch++) {
-					int sample = (*pab)*((float)INT_MAX);
-					for(int b=0; b<3; b++) {
-						sample >>=8; //shift byte down
-						*bp = sample&0xff; // mask and add to output
-						bp++; // increment output pointer
-					}
-					pab++;
-				}
-			}
+			encode_s24(ab, transfer->buffer, 2*nf);
 		}
 		int r=0;
 		r = libusb_submit_transfer(transfer); // queue it back up again
-		if(r<0) logger(1,"\n%s",libusb_strerror(r));
+		if(r<0) { logger(1,"\n%s",libusb_strerror(r)); inflight--; }
 	}
 }
 
 
 static void fb_in(struct libusb_transfer *transfer)
 {
-	static int cnt=0;
 	//fprintf(stderr,"f");
 	if(transfer->status != LIBUSB_TRANSFER_COMPLETED) {
 		logger(1,"!f\n"); // report failures
 	}
-	if(transfer->status != LIBUSB_TRANSFER_CANCELLED) {
-		libusb_submit_transfer(transfer); // queue it back up again
-		// accumulate feedback on samples required
+	cbcount++;
+	if(transfer->status == LIBUSB_TRANSFER_CANCELLED || stopping) {
+		inflight--;
+	} else {
+		// each feedback byte counts the frames the device wants per ms (nominally 96), 3 per ISO packet
+		// skip packets that did not arrive so stale bytes don't pull the rate
+		// packets are one microframe apart, the last one arrived just before this completion
+		double now = elapsed_ms();
+		double ts = 0; // time of the newest valid packet
 		unsigned int fSum = 0;
-		for(int i=0; i<6; i++) {
-			// add up each frequency counter
-			fSum += (unsigned int)transfer->buffer[i];
+		int nc = 0;
+		for(int p=0; p<transfer->num_iso_packets; p++) {
+			if(transfer->iso_packet_desc[p].status != 0 || transfer->iso_packet_desc[p].actual_length < 3) continue;
+			for(int i=0; i<3; i++) {
+				// add up each frequency counter
+				fSum += (unsigned int)transfer->buffer[p*3+i];
+			}
+			nc += 3;
+			ts = now-(transfer->num_iso_packets-1-p)*0.125;
 		}
-		outDelta += fSum-576;
+		if(nc>0) fb_update(fSum, nc, ts);
+		dump_record('F', transfer->buffer, transfer->length);
+		if(libusb_submit_transfer(transfer)<0) inflight--; // queue it back up again
 	}
 }
 
 static void bulk_in(struct libusb_transfer *transfer)
 {
 	//fprintf(stderr,"b");
+	cbcount++;
 	int r=0;
 	if(transfer->status != LIBUSB_TRANSFER_COMPLETED) {
 		logger(1,"!b\n"); // report failures
 		r=1;
+		inflight--; // not resubmitted, so this one has retired
 	}
 	if(transfer->status != LIBUSB_TRANSFER_CANCELLED) {
-		if(r==0) {
+		if(r==0) jitter_mark(&jit_bulk, elapsed_ms(), CAP_USB_LATENCY/96.0);
+		if(r==0 && stopping) {
+			// completed just before we cancelled it - don't queue it again
+			inflight--;
+		} else if(r==0 && running==0) {
+			// not started yet - discard so stale capture does not fill the ring before JACK runs
+			if(libusb_submit_transfer(transfer)<0) inflight--;
+		} else if(r==0) {
 			// process buffer into audio output
-			// format: rows of 32 bytes, of which 24 are valid, rest are padding
-			// each byte contain 1 bit of a sample, up to 5 samples/byte
-			// 2 rows make up all the channel samples for one frame
 			// 2048 frames per transfer or 4096 rows
-			char *bpos=transfer->buffer; // input byte position in transfer buffer
+			dump_record('B', transfer->buffer, transfer->actual_length);
 			int nr = (jack_ringbuffer_write_space(ib) / ibframe)*2; // how many rows of space have we got? Make sure this is a multiple of 2 so we don't drop half a frame..
 			
 			if (nr<4096) { // overrun! just drop data that does not fit
@@ -413,46 +844,32 @@ static void bulk_in(struct libusb_transfer *transfer)
 			
 			// process rows into temp
 			float a[10*2048];
-			float *ap = a;
-			for(int row=0;row<nr; row++) { // step through rows
-				// assemble row bits into 5 samples
-				int sample[5] = {0,0,0,0,0};
-				for(int b=0;b<24;b++) {
-					unsigned char bb = *bpos;
-					for(int ch=0; ch<5; ch++) {
-						sample[ch] <<= 1; // shift sample up one bit
-						sample[ch] |= 0x01&bb; // OR channel bit into sample
-						bb >>= 1; // shift to next channel bit
-					}
-					bpos++; // move to next buffer byte
-				}
-				// convert samples into floats and serialize into temp store
-				for(int s=0; s<5; s++) {
-					*ap = (sample[s]<<8)/(float)INT_MAX;
-					ap++;
-				}
-				// move transfer buffer point to next row
-				bpos+=8;
-			}
+			decode_rows(transfer->buffer, a, nr);
 			// write temp to ring buffer
 			if(jack_ringbuffer_write(ib, (void *) a, 5*nr*sample_size)<5*nr*sample_size) {
 				logger(1,"\nIN buffer error! QUIT\n"); // this should NOT happen!
 				done=1;
 			}
-			libusb_submit_transfer(transfer); // queue it back up again
+			if(libusb_submit_transfer(transfer)<0) inflight--; // queue it back up again
 		}	
 	}
 }
 
+// jack_activate() can take a while - run it off the USB thread so the transfer queues keep cycling meanwhile
+static void *activate_thread(void *arg) {
+	atomic_store(&activated, jack_activate(client) ? -1 : 1);
+	return NULL;
+}
+
 static void run_audio(libusb_device_handle *hdev, int epOut, int epInFb, int epInBulk) {
 	int r;
 	// transfer buffer handles
 	unsigned char *bulk[preload];
-	unsigned char *fb[preload];
+	unsigned char *fb[fbQueueMax];
 	unsigned char *ob[outpreload];
 	// transfer handles
 	struct libusb_transfer *transfer_bulk[preload];
-	struct libusb_transfer *transfer_fb[preload];
+	struct libusb_transfer *transfer_fb[fbQueueMax];
 	struct libusb_transfer *transfer_out[outpreload];
 
 	// clear any stalled ports
@@ -478,38 +895,67 @@ static void run_audio(libusb_device_handle *hdev, int epOut, int epInFb, int epI
 		logger(0,"submit_txfr(b)\n");
 		r = libusb_submit_transfer(transfer_bulk[i]);
 		if(r != 0) { logger(1, libusb_strerror(r)); return;}
+		inflight++;
 	}	
 	
 	// submit a queue of ISO FB transfers
-	for(int i=0; i<preload; i++) {
-		fb[i] = calloc(6,1);	// 2* 3 bytes
+	// fewer, bigger transfers cut the completion rate - the pacer only needs a filtered rate
+	for(int i=0; i<fbQueue; i++) {
+		fb[i] = calloc(3*fbPackets,1);	// 3 bytes per packet
 		// alloc input transfer struct
-		transfer_fb[i] = libusb_alloc_transfer(2); // two ISO packets per tx
+		transfer_fb[i] = libusb_alloc_transfer(fbPackets);
 		// fill transfer struct data
 		libusb_fill_iso_transfer( transfer_fb[i], hdev, epInFb,
-		    fb[i],  6, 2,
+		    fb[i],  3*fbPackets, fbPackets,
 		    fb_in, NULL, 0);
 		libusb_set_iso_packet_lengths(transfer_fb[i],3); // 3 bytes per packet
 		// submit request
 		logger(0,"submit_txfr(f)\n");
 		r = libusb_submit_transfer(transfer_fb[i]);
 		if(r != 0) { logger(1, libusb_strerror(r)); return;}
+		inflight++;
 	}
 	
 	// submit a queue of output transfers - keep it short as this adds latency!
 	for(int i=0; i<outpreload; i++) {
-		ob[i] = calloc(2886,1); // extra byte for underrun handling
-		transfer_out[i] = libusb_alloc_transfer(40);
+		ob[i] = calloc(outPackets*outPktMax*6,1); // room for the largest packets the pacer can ask for
+		transfer_out[i] = libusb_alloc_transfer(outPackets);
 		// fill transfer struct data
 		libusb_fill_iso_transfer( transfer_out[i], hdev, epOut,
-		    ob[i],  2880, 40,
-		    cb_out, NULL, 0);
-		libusb_set_iso_packet_lengths(transfer_out[i],72); // 72 bytes per packet
+		    ob[i],  outPackets*outPktFrames*6, outPackets,
+		    cb_out, ob[i], 0); // remember our own buffer, the direct path points transfers into its ring
+		libusb_set_iso_packet_lengths(transfer_out[i],outPktFrames*6); // 72 bytes per packet
 		// submit request
 		logger(0,"submit_txfr(o)\n");
 		r = libusb_submit_transfer(transfer_out[i]);
 		if(r != 0) { logger(1, libusb_strerror(r)); return;}
+		inflight++;
+	}
+
+	phase("usb_submit");
+
+	// queues are primed and streaming silence, now start JACK callbacks while the device spins up
+	// keep servicing USB here until activation is done, or the queues drain and the streams stall
+	logger(0, "JACK activate client\n");
+	pthread_t th;
+	if(pthread_create(&th, NULL, activate_thread, NULL) != 0) {
+		logger(1, "cannot start activation thread\n");
+		done=1;
+	} else {
+		while(atomic_load(&activated)==0) {
+			struct timeval tv;
+			tv.tv_usec = 10000;
+			tv.tv_sec = 0;
+			r = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+			if(r != 0) { logger(1, libusb_strerror(r)); break;}
+		}
+		pthread_join(th, NULL);
+		if(atomic_load(&activated)<0) {
+			logger(1, "cannot activate client");
+			done=1;
+		}
 	}
+	phase("jack_activate");
 
 	// run processing loop
 
@@ -518,47 +964,83 @@ static void run_audio(libusb_device_handle *hdev, int epOut, int epInFb, int epI
 	
 	// loop processing USB events (jack will callback as required without a loop)
 	running=1;
-	int cnt=0;
+	double t_status = elapsed_ms();
+	int reported=0;
+	// measure what the USB thread costs us, mostly down to the callback rate
+	struct rusage ru0, ru1;
+	getrusage(RUSAGE_THREAD, &ru0);
+	long cb0 = cbcount;
+	double t_run = elapsed_ms();
 	const int stdinfd = fileno(stdin);
 	while(done==0) {
 		// check for key press/stdin chars and stop
 		int n;
 		ioctl(stdinfd, FIONREAD, &n);
 		if(n>0) sig_handler(0);
+		if(reported==0 && t_first_audio>0) {
+			logger(1,"\ntime to first audio: %.1fms\n", t_first_audio);
+			reported=1;
+		}
+		// give the rings a second to settle before calibrating
+		if(calstate==1 && t_first_audio>0 && elapsed_ms()-t_first_audio>1000) {
+			logger(1,"\nCalibrating latency, playing test signal on 2-track out..\n");
+			calpos = 0;
+			calstate = 2;
+		}
+		if(calstate>=3) calibrate_step();
 		// blocking API call to poll asynch functions
 		//fprintf(stderr,"."); // tracer dots :)
             	r =  libusb_handle_events_completed(ctx, NULL);
 		if(r != 0) { logger(1, libusb_strerror(r)); break;}
-		if(++cnt>100) { 
-			cnt=0;
-			fprintf(stderr,"OUT: drop:%08ld add:%08ld fb:%+04d rbdata:%08ld IN: drop:%08ld add:%08ld ibdata:%08.1f\r",
-				rbdrop/2, rbadd/2, outDelta, rbavg/rbframe,
-				ibdrop/10, ibadd/10, ibavg/ibframe);
+		if(elapsed_ms()-t_status>100) { 
+			t_status=elapsed_ms();
+			adapt_targets();
+			fprintf(stderr,"OUT: drop:%08ld add:%08ld fb:%+07.1fppm age:%4.1fms rbdata:%08ld/%04d IN: drop:%08ld add:%08ld ibdata:%08.1f/%04d\r",
+				rbdrop/2, rbadd/2, ((int)(fbSlot>>32)-(outPktFrames<<16))*1e6/(outPktFrames<<16), fbAgeMax, rbavg/rbframe, rbtarget,
+				ibdrop/10, ibadd/10, ibavg/ibframe, ibtarget);
+			fbAgeMax = 0;
+			update_latency();
 		}
 	}
 	fflush(stdout);
 	running=0;
-	// cancel transfers and run the loop for another second
+	stopping=1; // from here a completion must not resubmit, or a transfer can slip past the cancel below
+	t_stop = elapsed_ms();
+	getrusage(RUSAGE_THREAD, &ru1);
+	double secs = (t_stop-t_run)/1000.0;
+	if(secs>0) {
+		double cpu = (ru1.ru_utime.tv_sec-ru0.ru_utime.tv_sec + ru1.ru_stime.tv_sec-ru0.ru_stime.tv_sec)
+			+ (ru1.ru_utime.tv_usec-ru0.ru_utime.tv_usec + ru1.ru_stime.tv_usec-ru0.ru_stime.tv_usec)/1000000.0;
+		logger(1,"\nUSB thread (feedback %dx%d): %.0f callbacks/s, CPU %.2f%%, context switches %.0f/s voluntary %.0f/s involuntary\n",
+			fbPackets, fbQueue, (cbcount-cb0)/secs, 100*cpu/secs,
+			(ru1.ru_nvcsw-ru0.ru_nvcsw)/secs, (ru1.ru_nivcsw-ru0.ru_nivcsw)/secs);
+	}
+	// cancel transfers and run the loop until they have all come back
 	
 	logger(0,"Cancelling transfers..\n");
 	for(int i=0;i<preload;i++) {
 		libusb_cancel_transfer(transfer_bulk[i]);
+	}
+	for(int i=0;i<fbQueue;i++) {
 		libusb_cancel_transfer(transfer_fb[i]);
 	}
 	for(int i=0; i<outpreload; i++) {
 		libusb_cancel_transfer(transfer_out[i]);
 	}
-	// run the loop again, use non-blocking mode and poll for ~1sec
-	cnt=0;
-	while(++cnt<1000) {
-		// non-blocking API call to poll asynch functions
+	// run the loop again until every callback has seen its cancellation - give up after 1sec in case the device went away
+	while(inflight>0 && elapsed_ms()-t_stop<1000) {
 		//fprintf(stderr,"."); // tracer dots :)
 		struct timeval tv;
-		tv.tv_usec = 0;
+		tv.tv_usec = 100000;
 		tv.tv_sec = 0;
             	r =  libusb_handle_events_timeout_completed(ctx, &tv, NULL);
 		if(r != 0) { logger(1, libusb_strerror(r)); break;}
-		usleep(1000);
+	}
+	phase("usb_cancel");
+	if(inflight>0) {
+		// libusb still owns these, freeing them now would be a use-after-free
+		logger(1,"%d transfers did not complete cancellation, leaking them\n",inflight);
+		return;
 	}
 
 	// free memory!
@@ -566,6 +1048,8 @@ static void run_audio(libusb_device_handle *hdev, int epOut, int epInFb, int epI
 	for(int i=0;i<preload;i++) {
 		libusb_free_transfer(transfer_bulk[i]);
 		free(bulk[i]);
+	}
+	for(int i=0;i<fbQueue;i++) {
 		libusb_free_transfer(transfer_fb[i]);
 		free(fb[i]);
 	}
@@ -575,6 +1059,143 @@ static void run_audio(libusb_device_handle *hdev, int epOut, int epInFb, int epI
 	}
 }
 
+// read back the current sample rate for the endpoint addressed by a SET_CUR control, returns 1 if it matches data
+static int check_rate(libusb_device_handle *hdev, uint16_t ctl[], unsigned char *data) {
+	unsigned char cur[3] = {0,0,0};
+	int r = libusb_control_transfer(hdev,0xff & (ctl[0]|USB_REQUEST_DIR_MASK),USB_REQUEST_UAC_GET_CUR,ctl[2],ctl[3],cur,ctl[4],100);
+	if(r != ctl[4]) { logger(0,"USB rate readback failed: %s\n", r<0 ? libusb_strerror(r) : "short"); return 0; }
+	logger(0,"USB rate(%02x): %d\n", ctl[3], cur[0]|(cur[1]<<8)|(cur[2]<<16));
+	return memcmp(cur,data,ctl[4])==0;
+}
+
+// detach kernel drivers, claim both interfaces and select the streaming alt settings
+static void claim_interfaces(libusb_device_handle *hdev, int tIn[], int tOut[]) {
+	int r;
+	// setup kernel driver swapout	
+	logger(0,"USB set_auto_detach\n");
+	r = libusb_set_auto_detach_kernel_driver(hdev,1);
+	if(r != 0) { logger(1, libusb_strerror(r));}
+	// get the interfaces
+	logger(0,"USB claim_interface(in)\n");
+	r = libusb_claim_interface(hdev,tIn[0]);
+	if(r != 0) { logger(1, libusb_strerror(r));}
+	logger(0,"USB claim_interface(out)\n");
+	r = libusb_claim_interface(hdev,tOut[0]);
+	if(r != 0) { logger(1, libusb_strerror(r));}
+	// set the alt setting = didn't see this in win capture but does not work without it on libusb..
+	logger(0,"USB alt_setting(in)\n");
+	r = libusb_set_interface_alt_setting(hdev,tIn[0],tIn[1]);
+	if(r != 0) { logger(1, libusb_strerror(r));}
+	logger(0,"USB alt_setting(out)\n");
+	r = libusb_set_interface_alt_setting(hdev,tOut[0],tOut[1]);
+	if(r != 0) { logger(1, libusb_strerror(r));}
+}
+
+// offline replay of a -d capture (or synthetic data for "-") through the ring and DSP kernels, no JACK or USB needed
+// runs the same code as the callbacks so it can train PGO builds and compare build variants
+// the JACK period and the USB transfers are run whenever their ring holds enough, which keeps both near target
+static int replay(const char *fname) {
+	FILE *f = NULL;
+	if(strcmp(fname,"-")!=0 && (f=fopen(fname,"rb"))==NULL) { logger(1,"cannot open %s\n",fname); return 1; }
+	static unsigned char buf[0x20000];
+	static float a[10*2048];
+	static jack_default_audio_sample_t ab[2*outPackets*outPktMax];
+	static unsigned char ob[outPackets*outPktMax*6];
+	static jack_default_audio_sample_t ports[12][REPLAY_PERIOD]; // stand-in JACK port buffers, 10 capture then 2 playback
+	struct libusb_iso_packet_descriptor desc[outPackets];
+	// something to play - 750Hz on both channels, a whole number of cycles per period
+	for(int i=0; i<REPLAY_PERIOD; i++) {
+		ports[10][i] = ports[11][i] = 0.5*sin(2*M_PI*750*i/96000.0);
+	}
+	rb = jack_ringbuffer_create(rbsize);
+	ib = jack_ringbuffer_create(ibsize);
+	if(direct) dring = calloc((DIRECT_FRAMES+DIRECT_GUARD)*6,1);
+	static unsigned char noise[0x20000]; // synthetic BULK payload, made up front so we time the kernels not rand()
+	unsigned int seed = 1;
+	for(int i=0; i<sizeof(noise); i++) noise[i] = rand_r(&seed);
+	unsigned int check = 0; // consume the output so the optimiser can't drop the work
+	long inframes=0, outframes=0, bulks=0, fbs=0, rec=0, periods=0;
+	double t0 = elapsed_ms();
+	while(inframes<REPLAY_FRAMES) {
+		int type, len;
+		if(f) {
+			type = fgetc(f);
+			if(type==EOF) {
+				if(bulks==0) { logger(1,"no BULK records in %s\n",fname); fclose(f); return 1; }
+				rewind(f); // loop the capture until we have done enough
+				continue;
+			}
+			if(fread(&len,sizeof(len),1,f)!=1 || len<0 || len>sizeof(buf) || fread(buf,1,len,f)!=len) {
+				logger(1,"%s: truncated record\n",fname); fclose(f); return 1;
+			}
+		} else if(rec++%(1+170/fbPackets)==0) {
+			// synthetic: a BULK transfer of noise every ~21ms..
+			type = 'B';
+			len = sizeof(noise);
+			memcpy(buf, noise, len);
+		} else {
+			// ..and the feedback transfers that arrive alongside it, 96 frames/ms with some jitter
+			type = 'F';
+			len = 3*fbPackets;
+			for(int i=0; i<len; i++) buf[i] = 96+(rand_r(&seed)%16==0);
+		}
+		if(type=='B') {
+			// as bulk_in, drop whatever does not fit
+			int nr = (len/32)&~1;
+			nr = nr>4096 ? 4096 : nr;
+			int room = (jack_ringbuffer_write_space(ib)/ibframe)*2;
+			nr = nr>room ? room : nr;
+			decode_rows(buf, a, nr);
+			jack_ringbuffer_write(ib, (void *)a, 5*nr*sample_size);
+			inframes += nr/2;
+			bulks++;
+		} else if(type=='F' && len>0) {
+			unsigned int fSum = 0;
+			for(int i=0; i<len; i++) fSum += buf[i];
+			fb_update(fSum, len, elapsed_ms());
+			fbs++;
+		}
+		// JACK periods until the capture ring is down to half a BULK transfer below target,
+		// so the depth seen after each read averages out at the target
+		while(jack_ringbuffer_read_space(ib) >= (ibtarget-CAP_USB_LATENCY/2+REPLAY_PERIOD)*ibframe) {
+			jack_default_audio_sample_t *out[10], *in[2];
+			for(int i=0; i<10; i++) out[i] = ports[i];
+			in[0] = ports[10];
+			in[1] = ports[11];
+			process_rings(out, in, REPLAY_PERIOD, 0);
+			check += (int)(ports[9][REPLAY_PERIOD-1]*65536);
+			periods++;
+			// then USB transfers while the playback ring is half a transfer above target
+			for(;;) {
+				int depth = direct ? atomic_load(&dwr)-atomic_load(&dres) : jack_ringbuffer_read_space(rb)/rbframe;
+				if(depth<rbtarget+outPackets*outPktFrames/2) break;
+				int nf = pace_packets(desc);
+				if(direct) {
+					// as cb_out, the frames are already encoded - reserve them and release straight away
+					unsigned int rd = atomic_load(&dres);
+					check += dring[(rd&(DIRECT_FRAMES-1))*6+6*nf-1];
+					atomic_store(&dres, rd+nf);
+					atomic_store(&drel, rd+nf);
+				} else {
+					jack_ringbuffer_read(rb, (void *)ab, nf*rbframe);
+					encode_s24(ab, ob, 2*nf);
+					check += ob[6*nf-1];
+				}
+				outframes += nf;
+			}
+		}
+	}
+	double t = elapsed_ms()-t0;
+	logger(1,"replay %s%s: %ld BULK + %ld FB records, %ld periods, %ld/%ld frames in/out in %.1fms = %.1fx realtime, %.2fns/frame (check %08x)\n",
+		f ? fname : "synthetic", direct ? " direct" : "", bulks, fbs, periods, inframes, outframes, t, inframes/96.0/t, t*1000000/inframes, check);
+	logger(1,"OUT: drop:%ld add:%ld IN: drop:%ld add:%ld (scaled as the status line)\n", rbdrop/2, rbadd/2, ibdrop/10, ibadd/10);
+	if(f) fclose(f);
+	jack_ringbuffer_free(rb);
+	jack_ringbuffer_free(ib);
+	free(dring);
+	return 0;
+}
+
 static libusb_device *find_dev(libusb_device **devs)
 {
 	libusb_device *dev, *rdev;
@@ -626,17 +1247,50 @@ int main(int argc, char **argv)
 	unsigned char d2[] = data2;
 	uint16_t ctl3[] = control3;
 	
-	const char **ports;
 	const char *client_name;
 	const char *server_name = NULL;
 	jack_options_t options = JackNullOption;
 	jack_status_t status;
 
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+
 	// process options
-	if(argc<2) { fprintf(stderr,"usage: %s <client name> [-v|-vv]\n",argv[0]); return 0; }
+	if(argc<2) {
+		fprintf(stderr,"usage: %s <client name> [-v|-vv] [-r] [-c|-l <frames>] [-d <dump file>] [-fp <packets>] [-fq <transfers>] [-D] [-a <probability>]\n",argv[0]);
+		fprintf(stderr,"       %s -R <dump file|-> [-D]\n",argv[0]);
+		return 0;
+	}
+	if(strcmp(argv[1],"-R")==0) {
+		direct = argc>3 && strcmp(argv[3],"-D")==0;
+		return replay(argc>2 ? argv[2] : "-");
+	}
 	client_name = argv[1];
-	if(argc>2 && strcmp(argv[2],"-v")==0) { debug=1; logger(0,"Debug ON\n"); }
-	if(argc>2 && strcmp(argv[2],"-vv")==0) { debug=2; logger(0,"Debug ON, USB debug ON\n"); }
+	for(int a=2; a<argc; a++) {
+		if(strcmp(argv[a],"-v")==0) { debug=1; logger(0,"Debug ON\n"); }
+		if(strcmp(argv[a],"-vv")==0) { debug=2; logger(0,"Debug ON, USB debug ON\n"); }
+		if(strcmp(argv[a],"-r")==0) { force_reset=1; logger(0,"Forcing device reset\n"); }
+		if(strcmp(argv[a],"-c")==0) { calstate=1; logger(0,"Latency calibration ON\n"); }
+		if(strcmp(argv[a],"-l")==0 && a+1<argc) { cal_offset=atoi(argv[++a]); logger(0,"Latency offset %+d\n",cal_offset); }
+		if(strcmp(argv[a],"-a")==0 && a+1<argc) {
+			adaptive = 1;
+			adapt_bound = atof(argv[++a]);
+			if(adapt_bound<=0 || adapt_bound>=1) { logger(1,"-a needs a probability between 0 and 1\n"); return 1; }
+			logger(0,"Adaptive ring targets ON, bound %g\n",adapt_bound);
+		}
+		if(strcmp(argv[a],"-D")==0) { direct=1; logger(0,"Direct playback path ON\n"); }
+		if(strcmp(argv[a],"-fp")==0 && a+1<argc) {
+			fbPackets = atoi(argv[++a]);
+			fbPackets = fbPackets<1 ? 1 : fbPackets>fbPacketsMax ? fbPacketsMax : fbPackets;
+		}
+		if(strcmp(argv[a],"-fq")==0 && a+1<argc) {
+			fbQueue = atoi(argv[++a]);
+			fbQueue = fbQueue<2 ? 2 : fbQueue>fbQueueMax ? fbQueueMax : fbQueue;
+		}
+		if(strcmp(argv[a],"-d")==0 && a+1<argc) {
+			dumpf = fopen(argv[++a],"wb");
+			if(dumpf==NULL) { logger(1,"cannot open dump file %s\n",argv[a]); return 1; }
+		}
+	}
 	
 	// INIT jack side first - no point opening USB if no jackd!
 	/* open a client connection to the JACK server */
@@ -658,6 +1312,7 @@ int main(int argc, char **argv)
 		client_name = jack_get_client_name(client);
 		logger(0, "unique name `%s' assigned\n", client_name);
 	}
+	phase("jack_open");
 
 	/* tell the JACK server to call `process()' whenever
 	   there is work to be done.
@@ -707,9 +1362,21 @@ int main(int argc, char **argv)
 	logger(0,"JACK create ring buffer\n");
 	rb = jack_ringbuffer_create(rbsize);
 	ib = jack_ringbuffer_create(ibsize);
+	if(calstate) {
+		mls = malloc(MLS_LENGTH*sizeof(float));
+		calbuf = calloc(MLS_LENGTH*10,sizeof(float));
+		mls_generate();
+	}
+	if(direct) {
+		// same target as the float ring - both only have to fill the next transfer when it completes, -a trims either
+		dring = calloc((DIRECT_FRAMES+DIRECT_GUARD)*6,1);
+	}
+	play_latency = PLAY_USB_LATENCY + rbtarget + cal_offset/2;
+	cap_latency = CAP_LATENCY + (cal_offset-cal_offset/2);
    
 	logger(0, "JACK set latency callback\n");
 	jack_set_latency_callback (client, jack_latency, NULL);
+	phase("jack_setup");
 
 	// INIT jack end
 	
@@ -743,35 +1410,37 @@ int main(int argc, char **argv)
 	// now free up the list after we used a pointer from it
 	logger(0,"USB free_device_list\n");
 	libusb_free_device_list(devs, 1);
+	phase("usb_open");
 	// do some munging here...
 	//investigate_dev(adev, hdev);
-	// open the output endpoint and start send/receive
-	// set config 0 then config 1 to reset device
-	logger(0,"USB set_configuration 0\n");
-	r = libusb_set_configuration(hdev,0);
-	if(r != 0) { logger(1, libusb_strerror(r));}
-	usleep(10000);	
-	logger(0,"USB set_configuration 1\n");
-	r = libusb_set_configuration(hdev,1);
-	if(r != 0) { logger(1, libusb_strerror(r));}
-	// setup kernel driver swapout	
-	logger(0,"USB set_auto_detach\n");
-	r = libusb_set_auto_detach_kernel_driver(hdev,1);
-	if(r != 0) { logger(1, libusb_strerror(r));}
-	// get the interfaces
-	logger(0,"USB claim_interface(in)\n");
-	r = libusb_claim_interface(hdev,tIn[0]);
-	if(r != 0) { logger(1, libusb_strerror(r));}
-	logger(0,"USB claim_interface(out)\n");
-	r = libusb_claim_interface(hdev,tOut[0]);
-	if(r != 0) { logger(1, libusb_strerror(r));}
-	// set the alt setting = didn't see this in win capture but does not work without it on libusb..
-	logger(0,"USB alt_setting(in)\n");
-	r = libusb_set_interface_alt_setting(hdev,tIn[0],tIn[1]);
-	if(r != 0) { logger(1, libusb_strerror(r));}
-	logger(0,"USB alt_setting(out)\n");
-	r = libusb_set_interface_alt_setting(hdev,tOut[0],tOut[1]);
-	if(r != 0) { logger(1, libusb_strerror(r));}
+	// a previous run normally leaves the device in config 1 streaming at 96k - if so skip the slow reset
+	int cfg = -1;
+	int reset = force_reset;
+	r = libusb_get_configuration(hdev,&cfg);
+	if(r != 0 || cfg != 1) reset = 1;
+	if(reset==0) {
+		claim_interfaces(hdev,tIn,tOut);
+		if(check_rate(hdev,ctl1,d1) && check_rate(hdev,ctl2,d2)) {
+			logger(0,"USB already configured, skipping reset\n");
+		} else {
+			libusb_release_interface(hdev,tOut[0]);
+			libusb_release_interface(hdev,tIn[0]);
+			reset = 1;
+		}
+	}
+	if(reset) {
+		// open the output endpoint and start send/receive
+		// set config 0 then config 1 to reset device
+		logger(0,"USB set_configuration 0\n");
+		r = libusb_set_configuration(hdev,0);
+		if(r != 0) { logger(1, libusb_strerror(r));}
+		usleep(10000);	
+		logger(0,"USB set_configuration 1\n");
+		r = libusb_set_configuration(hdev,1);
+		if(r != 0) { logger(1, libusb_strerror(r));}
+		claim_interfaces(hdev,tIn,tOut);
+	}
+	phase("usb_config");
 
 	// check max packet sizes
 	logger(0,"USB maxPkt(o):%x\n",libusb_get_max_iso_packet_size(adev,tOut[2]));
@@ -780,26 +1449,20 @@ int main(int argc, char **argv)
 
 
 	// send vendor controls to set 96k streaming - yes it sends this multiple times! Who knows why... I'm not going to
-	for(int i=0;i<ctlRepeat;i++) {
+	// (rate is already set if we skipped the reset)
+	for(int i=0;i<ctlRepeat && reset;i++) {
 		send_control(hdev,ctl1,d1);
 		send_control(hdev,ctl2,d2);
 	}
 	send_control(hdev,ctl3,NULL); // this is only sent once. Wierd...
+	phase("usb_controls");
 	
 	// INIT USB end
 
 	logger(0,"Interfaces open! process audio... target RB=%d-%d/%d, target IB=%d-%d/%d\n",
 		rbtlow/rbframe,rbthigh/rbframe,rbsize/rbframe,ibtlow/ibframe,ibthigh/ibframe,ibsize/ibframe);
 
-	// start JACK callbacks here
-
-	logger(0, "JACK activate client\n");
-	if (jack_activate (client)) {
-		logger(1, "cannot activate client");
-		exit (1);
-	}
-	
-	// start USB transactions here
+	// start USB transactions here, JACK callbacks are activated once the queues are primed
 		
 	run_audio(hdev,tOut[2],tIn[2],tIn[3]);
 	
@@ -817,6 +1480,12 @@ int main(int argc, char **argv)
 	jack_ringbuffer_free(rb);
 	jack_ringbuffer_free(ib);
 	jack_client_close(client);
+	free(mls);
+	free(calbuf);
+	free(dring);
+	if(dumpf) fclose(dumpf);
+	phase("cleanup");
+	logger(1,"time to exit: %.1fms\n", elapsed_ms()-t_stop);
 
 	return 0;
 }